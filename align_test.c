@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Checks that every block malloc hands out is 16 byte aligned, and that blocks of a
+// power of two size up to a page are aligned to their size
+// Run with LD_PRELOAD=./libmyalloc.so ./align_test
+
+#define MAX_SIZE (300 * 1024)
+#define PAGE 4096
+
+static int isPowerOfTwo(size_t n)
+{
+	return (n & (n - 1)) == 0;
+}
+
+static void checkAligned(void *p, size_t size)
+{
+	assert(p != NULL);
+	assert((uintptr_t)p % 16 == 0);
+	if (isPowerOfTwo(size) && size >= 16 && size <= PAGE)
+	{
+		assert((uintptr_t)p % size == 0);
+	}
+}
+
+int main()
+{
+	// Every size up to a few pages, then the bigger ones more sparsely
+	for (size_t size = 1; size <= MAX_SIZE; size += (size < 3 * PAGE ? 1 : 509))
+	{
+		uint8_t *a = malloc(size);
+		uint8_t *b = malloc(size);
+		checkAligned(a, size);
+		checkAligned(b, size);
+		memset(a, 1, size);
+		memset(b, 2, size);
+		free(a);
+		free(b);
+	}
+
+	// Power of two sizes, lots of them at once so they come from several spans
+	for (size_t size = 16; size <= PAGE; size *= 2)
+	{
+		void *bufs[100];
+		for (int i = 0; i < 100; i++)
+		{
+			bufs[i] = malloc(size);
+			checkAligned(bufs[i], size);
+		}
+		for (int i = 0; i < 100; i++)
+		{
+			free(bufs[i]);
+		}
+	}
+
+	// calloc and realloc go through malloc, but check them too
+	for (size_t size = 1; size <= 2 * PAGE; size += 7)
+	{
+		void *c = calloc(1, size);
+		checkAligned(c, 16);
+		c = realloc(c, size * 3);
+		checkAligned(c, 16);
+		free(c);
+	}
+
+	printf("align_test passed\n");
+	return 0;
+}
@@ -1,118 +1,1668 @@
+#define _GNU_SOURCE
 #include <sys/mman.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include "allocator.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Per-CPU caches need restartable sequences, which are only written for x86-64 Linux
+#if defined(__x86_64__) && defined(__linux__)
+#include <linux/rseq.h>
+#define HAVE_RSEQ 1
+#endif
 
 #define PAGE_SIZE 4096
-#define MAX_SMALL 1024
-
-// Struct to hold the page headers that will have the size of the memory blocks
-// and the list of free memory that can be used
-typedef struct PageHeader {
-    size_t block_size;
-    void *free_list;
-    struct PageHeader *next;    //Pointer to next free memory block of a certain size
-} PageHeader;
-
-// Struct to hold the headers for the really large (>1024) memory blocks
-// holds the size of the requested memory and the amount of blocks we allocated 
-typedef struct LargeHeader {
-    size_t size;
-    size_t mmap_size;
-} LargeHeader;
-
-// Global lists & an initializer variable to help with an LD_PRELOAD issue
-static void *allFreeLists[11] = {NULL};
-static PageHeader *pageLists[11] = {NULL};
+#define MAX_SMALL (256 * 1024)
+#define NUM_CLASSES 52
+
+// Every block is at least this aligned, like glibc's malloc (enough for max_align_t and SSE)
+#define MIN_ALIGN 16
+
+// Thread caches move blocks to and from their arena in batches of up to this many,
+// and flush a batch back once a list grows past two batches. Classes above 2KB get
+// smaller batches of about BATCH_BYTES (at least MIN_BATCH blocks) so caches don't hoard
+#define CACHE_BATCH 32
+#define BATCH_BYTES (64 * 1024)
+#define MIN_BATCH 2
+
+// Upper bound on arenas, the default is one per CPU we may run on (MYALLOC_ARENAS overrides it)
+#define MAX_ARENAS 64
+
+// NUMA nodes we keep separate arenas and page pools for. Arena i belongs to node i % numNodes,
+// and memory is placed with the raw mbind syscall so libnuma isn't needed
+#define MAX_NODES 64
+#define MPOL_PREFERRED 1
+
+// Each arena's free list for a class is split into this many shards with their own locks,
+// and each shard keeps up to TRANSFER_SLOTS full batches ready to hand out whole
+#define CENTRAL_SHARDS 4
+#define TRANSFER_SLOTS 16
+
+// Empty pages are mapped this many at a time into the shared page pool
+#define POOL_CHUNK_PAGES 64
+
+// Size classes are carved out of spans of up to SPAN_MAX_PAGES pages. A class gets the
+// fewest pages that hold a batch of blocks with less than an eighth of the span left over
+#define SPAN_MAX_PAGES 256
+
+// Spans are coloured: the blocks of each new span of a class start a different number of cache
+// lines in, using the space left over at the end, so the first blocks of different spans don't
+// all land in the same cache sets
+#define CACHE_LINE 64
+
+// Bitmap slab mode (MYALLOC_BITMAP=1) tracks free blocks with one bit each in the span record
+// No span holds more than a page of the smallest blocks, which is PAGE_SIZE / MIN_ALIGN bits
+#define SPAN_BITMAP_WORDS (PAGE_SIZE / MIN_ALIGN / 64)
+
+// Each shard keeps this many empty bitmap spans as they are, further ones get their memory
+// given back with madvise so churn right at a span boundary doesn't make a syscall every time
+#define SPAN_KEEP_EMPTY 2
+
+// The page map is a two-level radix tree over page numbers (36 bits, see POOL_ADDR_BITS)
+// The root is a static array and each leaf covers 1GB of address space
+#define PAGE_MAP_LEAF_BITS 18
+#define PAGE_MAP_ROOT_BITS (POOL_ADDR_BITS - PAGE_MAP_LEAF_BITS)
+
+// The pool's head packs a page number (addresses fit in 48 bits, so 36 bits of page number)
+// together with a tag in the remaining 28 bits that changes on every update
+#define POOL_ADDR_BITS 36
+
+// Freed large mappings are kept per NUMA node for reuse, up to MYALLOC_LARGE_CACHE bytes on each
+// node (LARGE_CACHE_DEFAULT if unset, 0 turns it off). Anything left unused for MYALLOC_LARGE_DECAY_MS
+// is unmapped the next time that node's cache is used. Mappings are bucketed by page count
+// with four buckets per doubling, like the size classes
+#define LARGE_CACHE_DEFAULT (64 * 1024 * 1024)
+#define LARGE_DECAY_DEFAULT_MS 1000
+#define LARGE_BUCKETS 140
+
+// Large blocks of at least MYALLOC_THP_THRESHOLD bytes (off if unset or 0) get mappings aligned
+// to a transparent huge page and rounded up to whole ones, so the kernel can back them with
+// 2MB pages and save TLB misses
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Thread cache records are carved out of mmap'd chunks of this size, and span records too
+#define CACHE_CHUNK (16 * PAGE_SIZE)
+
+// Per-CPU mode (MYALLOC_PERCPU=1) keeps up to CPU_SLOTS blocks per class for each CPU id below MAX_CPUS
+#define CPU_SLOTS 64
+#define MAX_CPUS 1024
+#define RSEQ_SIGNATURE 0x53053053
+
+struct ThreadCache;
+struct Arena;
+
+// Struct to hold what we know about a span of pages: either a span of blocks of one size
+// class or one large block. It lives outside the pages in its own records, and the page map
+// points the span's pages at it, so the pages hold nothing but blocks
+typedef struct Span {
+    void *start;
+    size_t pages;
+    size_t block_size;          //Size of the blocks, 0 for a large block
+    size_t size;                //Large blocks only, the size that was asked for
+    int zeroed;                 //Large blocks only, set while the mapping is fresh from mmap and still all zero
+    struct Span *next;          //Next span of the same size class in the arena, or next free record
+    struct ThreadCache *owner;  //Thread cache that mapped this span, other threads free to it remotely
+    uint32_t class_index;       //Size class of the blocks so free doesn't have to work it out again
+    uint32_t arena_id;          //Which arena in arenas[] the span was mapped for
+    uint32_t color;             //Bytes from start to the first block, a multiple of CACHE_LINE
+    uint32_t blocks;
+
+    // Bitmap mode only, everything below is changed with the span's shard lock held
+    uint32_t shard;             //Shard of the arena's lists the span's free blocks belong to
+    uint32_t free_count;        //Blocks with their bit set, equal to blocks means the span is empty
+    uint32_t kept_empty;        //Empty and counted in the shard's empty_spans
+    struct Span *partial_next;  //Neighbours on the shard's list of spans with free blocks
+    struct Span *partial_prev;
+    uint64_t bitmap[SPAN_BITMAP_WORDS];     //Set bit = free block
+
+    // Large blocks only, changed with the node's large cache lock held
+    uint32_t node;              //Node the mapping was bound to
+    uint64_t freed_at;          //When it went in the cache, in milliseconds
+    struct Span *bucket_next;   //Neighbours in its cache bucket
+    struct Span *bucket_prev;
+    struct Span *newer;         //Neighbours in the cache ordered by when they were freed
+    struct Span *older;
+} Span;
+
+// Struct written at the start of a run of empty pages while it sits in the page pool
+typedef struct PoolRun {
+    struct PoolRun *next;
+    size_t pages;
+} PoolRun;
+
+// Struct for the per-thread cache that sits in front of its arena. Each thread
+// pops and pushes its own lists with no locking and only takes the arena lock to
+// refill or flush a whole batch of blocks at once
+// Blocks freed by other threads into pages this cache owns are pushed onto remote_free
+// with a single CAS, kept on their own cache line so those pushes don't bounce the owner's lists
+typedef struct ThreadCache {
+    void *lists[NUM_CLASSES];
+    int counts[NUM_CLASSES];
+    struct Arena *arena;        //Arena this thread refills from and flushes to
+    int shard;                  //Shard of the arena's lists this thread uses first
+    struct ThreadCache *next;       //Every cache ever made, for the fork handlers
+    struct ThreadCache *next_free;  //Caches whose thread is gone and can be handed to a new one
+    atomic_int in_use;              //Cleared once the thread exits so remote frees go to the arena instead
+    _Alignas(64) _Atomic(void *) remote_free[NUM_CLASSES];
+} ThreadCache;
+
+// Struct for a per-CPU cache, used instead of thread caches in per-CPU mode so the number of
+// caches is bounded by the core count. Each class is a stack of slots where counts[index] is the
+// top, and it is only ever changed inside a restartable sequence on that CPU
+// The arena and shard are picked from the CPU's NUMA node when the cache is made
+typedef struct CpuCache {
+    uintptr_t counts[NUM_CLASSES];
+    void *slots[NUM_CLASSES][CPU_SLOTS];
+    struct Arena *arena;
+    int shard;
+} CpuCache;
+
+// Struct for the counters kept next to each arena and shard lock when MYALLOC_LOCK_STATS=1
+// They are only updated while holding the lock they describe, so they need no atomics
+typedef struct LockStats {
+    uint64_t acquisitions;
+    uint64_t contended;     //Acquisitions that found the lock already held
+    uint64_t wait_cycles;   //Time spent waiting on those, in TSC cycles (nanoseconds off x86)
+} LockStats;
+
+// Struct for the counters each arena keeps, only updated with the arena lock held
+typedef struct ArenaStats {
+    size_t pages_mapped;
+} ArenaStats;
+
+// Struct for one shard of an arena's free list for a size class. Blocks come and go in
+// transfer batches: chains of exactly one class batch of blocks that are stored and handed out
+// whole, so one lock acquisition moves a full batch. Anything that isn't a full batch
+// (leftovers from exiting threads) goes on the loose list, and blocks of a new span that
+// nobody has used yet are handed out from the bump range
+// Everything in here is only touched with lock held
+typedef struct CentralList {
+    pthread_mutex_t lock;
+    void *batches[TRANSFER_SLOTS];  //Each one a NULL-terminated chain of CACHE_BATCH blocks
+    int num_batches;
+    void *loose;
+    size_t loose_count;
+    size_t refills;
+    size_t flushes;
+    LockStats lock_stats;
+    uint8_t *bump;          //Next never-used block of the shard's newest span
+    size_t bump_left;       //How many never-used blocks are left from bump on
+    struct Span *partial;   //Bitmap mode: spans of this shard with free blocks, used instead of the lists
+    int empty_spans;        //Bitmap mode: empty spans on partial that still have their memory
+    struct Span *released;  //Bitmap mode: empty spans whose memory was given back, used last
+} __attribute__((aligned(64))) CentralList;
+
+// Struct for an arena, which is one independent heap of free lists and pages. Threads are
+// spread over the arenas so they don't all wait on the same lock when refilling or flushing
+// The free lists are sharded with their own locks, lock only covers the page lists and stats
+typedef struct Arena {
+    pthread_mutex_t lock;
+    int node;                   //NUMA node this arena's pages are placed on
+    Span *pageLists[NUM_CLASSES];
+    unsigned int nextColor[NUM_CLASSES];    //Counts up for each new span, the span's color comes from it
+    ArenaStats stats;
+    LockStats lock_stats;
+    CentralList allFreeLists[NUM_CLASSES][CENTRAL_SHARDS];
+} Arena;
+
+// Global arenas & an initializer variable to help with an LD_PRELOAD issue
+static Arena arenas[MAX_ARENAS] = { [0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+static int numArenas = 1;
+static int numNodes = 1;
+static int lockStatsOn = 0;
+static int bitmapMode = 0;
+static atomic_uint nextArena = 0;
 static int initialized = 0;
 
+// Lock-free stack of runs of empty pages that any thread can take a page from, one per NUMA
+// node and each on its own cache line. The head is a tagged pointer (see POOL_ADDR_BITS)
+// so a pop can't succeed against a stale head (ABA)
+typedef struct PagePool {
+    _Alignas(64) _Atomic uint64_t head;
+} PagePool;
+
+static PagePool pagePools[MAX_NODES];
+
+// Cache of freed large mappings for one node. Each bucket is a list of mappings, and all of
+// them are also on one list from newest to oldest so decay and the byte cap drop the oldest
+typedef struct LargeCache {
+    pthread_mutex_t lock;
+    Span *buckets[LARGE_BUCKETS];
+    Span *newest;
+    Span *oldest;
+    size_t bytes;
+} LargeCache;
+
+static LargeCache largeCaches[MAX_NODES] = { [0 ... MAX_NODES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+static size_t largeCacheCap = 0;
+static uint64_t largeDecayMs = 0;
+static size_t thpThreshold = 0;
+
+// Page number -> the span it belongs to. Every page of a small span is set since a block can
+// be anywhere in it, large blocks only set their first page and clear it again when unmapped
+static _Atomic(Span **) pageMap[1 << PAGE_MAP_ROOT_BITS];
+
+// Span records, carved out of mmap'd chunks like thread caches. Small spans are never
+// given back, records of unmapped large blocks are kept on freeSpans for reuse
+static uint8_t *spanChunk = NULL;
+static size_t spanChunkLeft = 0;
+static Span *freeSpans = NULL;
+static pthread_mutex_t spanLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Thread cache records live in mmap'd memory rather than TLS so a page's owner pointer
+// stays valid for remote frees no matter which thread does them
+static uint8_t *cacheChunk = NULL;
+static size_t cacheChunkLeft = 0;
+static ThreadCache *allCaches = NULL;
+static ThreadCache *freeCaches = NULL;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Key whose destructor hands a thread's cache back when the thread exits
+static pthread_key_t cacheKey;
+static int cacheKeyReady = 0;
+
+// Each thread's own cache, initial-exec so reaching it never goes through __tls_get_addr
+static __thread ThreadCache *tcache __attribute__((tls_model("initial-exec"))) = NULL;
+
+// Per-CPU mode state, the caches themselves are mapped the first time a CPU needs one
+static int perCpuMode = 0;
+static CpuCache *cpuCaches[MAX_CPUS] = {NULL};
+
+#ifdef HAVE_RSEQ
+// glibc 2.35+ registers an rseq area for every thread and exports where it is. Weak so
+// the library still loads on an older glibc, where we register our own area instead
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+static __thread struct rseq ownRseq __attribute__((tls_model("initial-exec")));
+static __thread struct rseq *rseqArea __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread int rseqTried __attribute__((tls_model("initial-exec"))) = 0;
+#endif
+
+
+// Block sizes for each size class. Every 16 bytes up to 128, then four classes per doubling
+// (steps of a quarter of the power of two below), so a request never wastes more than
+// about 20% of its block instead of up to half with power-of-two classes
+// Every size is a multiple of MIN_ALIGN and spans start on a page, so every block is 16 byte
+// aligned, and blocks of a power of two class up to PAGE_SIZE are aligned to their size
+static const size_t classSizes[NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384,
+    20480, 24576, 28672, 32768,
+    40960, 49152, 57344, 65536,
+    81920, 98304, 114688, 131072,
+    163840, 196608, 229376, 262144
+};
+
+// Batch size and span length of each class, worked out once by initClasses()
+static int classBatch[NUM_CLASSES];
+static size_t classPages[NUM_CLASSES];
+
 
 // HELPER FUNCTIONS
-// Function to help get a page size from the amount requested, will also
-// make sure that the sizes are in correct bounds 
-static size_t roundPageSize(size_t size) {
-    
-    // Smallest we can allocate is void pointer 
-    size_t min = sizeof(void *);
+// Maps a request size (at least 1) straight to the smallest size class that fits it in
+// constant time, no loops. Up to 128 bytes the classes are every 16 bytes so it's just a
+// shift. Above that, the highest set bit of size - 1 picks the doubling (four classes
+// each) and the two bits below it pick the class inside that doubling
+static inline int sizeToIndex(size_t size) {
+    if (size <= 128) {
+        return (int)((size + 15) >> 4) - 1;
+    }
+    size_t x = size - 1;
+    int lg = 63 - __builtin_clzll((unsigned long long)x);
+    return 8 + (lg - 7) * 4 + (int)((x >> (lg - 2)) & 3);
+}
+
+// LOCK HELPERS
+// Reads a cheap timestamp for measuring lock waits
+static uint64_t readCycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
 
-    // Fix the inputted size if it is less than that
-    if (size < min){
-        size = min;
+// Takes an arena or shard lock, counting the acquisition when lock stats are on. A trylock
+// first tells us whether it was contended, and only then do we time the wait
+static void lockCounted(pthread_mutex_t *lock, LockStats *stats) {
+    if (!lockStatsOn) {
+        pthread_mutex_lock(lock);
+        return;
     }
-    // Fixing the size of input here using binary operations instead of if statements
-    // idea from office hours
-    size_t p = 1;
-    while (p < size) {
-        p <<= 1;
+    if (pthread_mutex_trylock(lock) == 0) {
+        stats -> acquisitions++;
+        return;
     }
-    return p;
+    uint64_t start = readCycles();
+    pthread_mutex_lock(lock);
+    stats -> acquisitions++;
+    stats -> contended++;
+    stats -> wait_cycles += readCycles() - start;
 }
 
-// Same thing as rounding the page size except for finding size blocks in linked list
-static int sizeToIndex(size_t size) {
-    int index = 0;
+// NUMA HELPERS
+// Counts the NUMA nodes from sysfs with plain syscalls (no stdio, which would allocate)
+// "possible" looks like "0" or "0-3", so the node count is one more than the last number
+static int countNodes(void) {
+    char buf[64];
+    int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 1;
+    }
+    buf[len] = '\0';
 
-    // Loop until the index reaches one that can fit the size inputted
-    // avoiding slow if-statements by using binary operations
-    size_t min = sizeof(void *);
-    while (min < size && index < 10) {
-        min <<= 1;
-        index++;
+    int last = 0;
+    for (ssize_t i = 0; i < len; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            last = last * 10 + (buf[i] - '0');
+        } else if (buf[i] == '-' || buf[i] == ',') {
+            last = 0;
+        }
     }
-    return index;
+    return last + 1 > MAX_NODES ? MAX_NODES : last + 1;
 }
 
-// Will allocate a page of memory for a request. Creates its own free list which has
-// all of the free space for the block and updates global variables accordingly
-static void allocatePage(size_t block_size, int index) {
-    
-    // Calling mmap - from GitHub example
-    // Requests page of memory from OS
-    void *page = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+// Returns the NUMA node the calling thread is running on right now
+static int currentNode(void) {
+    if (numNodes == 1) {
+        return 0;
+    }
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= (unsigned int)numNodes) {
+        return 0;
+    }
+    return (int)node;
+}
 
-    if (page == MAP_FAILED){        // Shouldn't happen, but just validation
+// Asks the kernel to place a fresh (not yet touched) mapping on a node, nothing to do with one node
+static void bindToNode(void *addr, size_t len, int node) {
+    if (numNodes == 1) {
         return;
     }
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, (unsigned long)MAX_NODES + 1, 0);
+}
 
-    // Initialize a header for a page to be allocated w characteristics
-    PageHeader *header = (PageHeader *)page;
-    header -> block_size = block_size;
+// Packs a run and a tag into one word for the pool head, and unpacks the run again
+static uint64_t poolWord(PoolRun *run, uint64_t tag) {
+    return ((uintptr_t)run >> 12) | (tag << POOL_ADDR_BITS);
+}
 
-    // Put header in pageList for tracking & put it in its size list
-    header -> next = pageLists[index];
-    pageLists[index] = header;
+static PoolRun *poolRun(uint64_t word) {
+    return (PoolRun *)(uintptr_t)((word & ((1ULL << POOL_ADDR_BITS) - 1)) << 12);
+}
 
-    // Figure out how much data can be put into block by subtracting header from total space
-    size_t header_size = sizeof(PageHeader);
-    size_t usable_bytes = PAGE_SIZE - header_size;
-    int blocks = usable_bytes / block_size;
+// Pushes a run of empty pages onto a pool with one CAS
+static void poolPush(PagePool *pool, PoolRun *run) {
+    uint64_t old = atomic_load_explicit(&pool -> head, memory_order_relaxed);
+    do {
+        run -> next = poolRun(old);
+    } while (!atomic_compare_exchange_weak_explicit(&pool -> head, &old, poolWord(run, (old >> POOL_ADDR_BITS) + 1),
+                                                    memory_order_release, memory_order_relaxed));
+}
 
-    // Validation - probably dont need
-    if (blocks <= 0) {
-        return;
+// Pops a run off the pool, or returns NULL if it is empty. Pool pages are never unmapped,
+// so reading next from a run another thread just took is safe, and the tag makes our CAS fail
+static PoolRun *poolPop(PagePool *pool) {
+    uint64_t old = atomic_load_explicit(&pool -> head, memory_order_acquire);
+    for (;;) {
+        PoolRun *run = poolRun(old);
+        if (run == NULL) {
+            return NULL;
+        }
+        PoolRun *next = __atomic_load_n(&run -> next, __ATOMIC_RELAXED);
+        if (atomic_compare_exchange_weak_explicit(&pool -> head, &old, poolWord(next, (old >> POOL_ADDR_BITS) + 1),
+                                                  memory_order_acquire, memory_order_acquire)) {
+            return run;
+        }
     }
+}
 
-    // Pointer to first place info can start after header, put this in free_list
-    uint8_t *base = (uint8_t *)page + header_size;
-    header -> free_list = base;
+// Gets one empty page from a node's pool, only calling mmap when the pool is empty. A new chunk
+// is bound to the node before anything touches it, then goes in as a single run. Runs are split
+// one page at a time, so the pages we haven't handed out yet are never touched
+static void *getPoolPage(int node) {
+    PagePool *pool = &pagePools[node];
+    PoolRun *run = poolPop(pool);
+    if (run == NULL) {
+        void *chunk = mmap(NULL, POOL_CHUNK_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+        bindToNode(chunk, POOL_CHUNK_PAGES * PAGE_SIZE, node);
+        run = (PoolRun *)chunk;
+        run -> pages = POOL_CHUNK_PAGES;
+    }
 
-    // Loop through all blocks in the free list and link together (free list for this page)
-    for (int i = 0; i < (blocks - 1); i++) {
+    // Keep the first page and put the rest of the run back
+    if (run -> pages > 1) {
+        PoolRun *rest = (PoolRun *)((uint8_t *)run + PAGE_SIZE);
+        rest -> pages = run -> pages - 1;
+        poolPush(pool, rest);
+    }
+    return run;
+}
+
+// Gets a run of empty pages from a node's pool. A run that is too short is left for a
+// smaller span and a fresh chunk is mapped instead
+static void *getPoolPages(int node, size_t pages) {
+    if (pages == 1) {
+        return getPoolPage(node);
+    }
+    PagePool *pool = &pagePools[node];
+    PoolRun *run = poolPop(pool);
+    PoolRun *short_run = NULL;
+    if (run != NULL && run -> pages < pages) {
+        short_run = run;
+        run = NULL;
+    }
+    // Spans bigger than a pool chunk get a mapping of their own
+    if (run == NULL) {
+        size_t chunk_pages = pages > POOL_CHUNK_PAGES ? pages : POOL_CHUNK_PAGES;
+        void *chunk = mmap(NULL, chunk_pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk != MAP_FAILED) {
+            bindToNode(chunk, chunk_pages * PAGE_SIZE, node);
+            run = (PoolRun *)chunk;
+            run -> pages = chunk_pages;
+        }
+    }
+    if (short_run != NULL) {
+        poolPush(pool, short_run);
+    }
+    if (run == NULL) {
+        return NULL;
+    }
+
+    // Keep the first pages and put the rest of the run back
+    if (run -> pages > pages) {
+        PoolRun *rest = (PoolRun *)((uint8_t *)run + pages * PAGE_SIZE);
+        rest -> pages = run -> pages - pages;
+        poolPush(pool, rest);
+    }
+    return run;
+}
+
+// Works out how many pages a span for a size class gets, see SPAN_MAX_PAGES
+static size_t spanPages(size_t block_size, size_t min_blocks) {
+    for (size_t pages = 1; pages < SPAN_MAX_PAGES; pages++) {
+        size_t blocks = pages * PAGE_SIZE / block_size;
+        size_t waste = pages * PAGE_SIZE - blocks * block_size;
+        if (blocks >= min_blocks && waste * 8 <= pages * PAGE_SIZE) {
+            return pages;
+        }
+    }
+    return SPAN_MAX_PAGES;
+}
+
+// Fills in the batch size and span length of every class, see CACHE_BATCH
+static void initClasses(void) {
+    for (int index = 0; index < NUM_CLASSES; index++) {
+        size_t batch = BATCH_BYTES / classSizes[index];
+        if (batch > CACHE_BATCH) {
+            batch = CACHE_BATCH;
+        }
+        if (batch < MIN_BATCH) {
+            batch = MIN_BATCH;
+        }
+        classBatch[index] = (int)batch;
+        classPages[index] = spanPages(classSizes[index], batch);
+    }
+}
+
+// Finds the page map leaf for a page number, mapping it first if create is set
+// Two threads making the same leaf race with a CAS and the loser unmaps its copy
+// Pages past the end of the map (addresses above 48 bits) can't be ours, so they get NULL
+static Span **pageMapLeaf(uintptr_t page, int create) {
+    if ((page >> PAGE_MAP_LEAF_BITS) >= (1 << PAGE_MAP_ROOT_BITS)) {
+        return NULL;
+    }
+    _Atomic(Span **) *slot = &pageMap[page >> PAGE_MAP_LEAF_BITS];
+    Span **leaf = atomic_load_explicit(slot, memory_order_acquire);
+    if (leaf != NULL || !create) {
+        return leaf;
+    }
+    size_t leaf_size = sizeof(Span *) << PAGE_MAP_LEAF_BITS;
+    Span **fresh = mmap(NULL, leaf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) {
+        return NULL;
+    }
+    if (!atomic_compare_exchange_strong_explicit(slot, &leaf, fresh, memory_order_acq_rel, memory_order_acquire)) {
+        munmap(fresh, leaf_size);
+        return leaf;
+    }
+    return fresh;
+}
+
+// Points pages of memory at a span, or at NULL to forget them. Returns 0 if a leaf couldn't be mapped
+static int pageMapSet(void *start, size_t pages, Span *span) {
+    uintptr_t first = (uintptr_t)start >> 12;
+    for (uintptr_t page = first; page < first + pages; page++) {
+        Span **leaf = pageMapLeaf(page, 1);
+        if (leaf == NULL) {
+            return 0;
+        }
+        leaf[page & ((1 << PAGE_MAP_LEAF_BITS) - 1)] = span;
+    }
+    return 1;
+}
+
+// Looks up the span a pointer is in, NULL if it isn't one of ours
+static inline Span *pageToSpan(const void *ptr) {
+    uintptr_t page = (uintptr_t)ptr >> 12;
+    Span **leaf = pageMapLeaf(page, 0);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return leaf[page & ((1 << PAGE_MAP_LEAF_BITS) - 1)];
+}
+
+// Gets a zeroed span record, reusing one from an unmapped large block if there is one
+// Returns NULL if no memory could be mapped for it
+static Span *newSpan(void) {
+    pthread_mutex_lock(&spanLock);
+    Span *span = freeSpans;
+    if (span != NULL) {
+        freeSpans = span -> next;
+        memset(span, 0, sizeof(Span));
+    } else {
+        if (spanChunkLeft < sizeof(Span)) {
+            void *chunk = mmap(NULL, CACHE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk == MAP_FAILED) {
+                pthread_mutex_unlock(&spanLock);
+                return NULL;
+            }
+            spanChunk = chunk;
+            spanChunkLeft = CACHE_CHUNK;
+        }
+        span = (Span *)spanChunk;
+        spanChunk += sizeof(Span);
+        spanChunkLeft -= sizeof(Span);
+    }
+    pthread_mutex_unlock(&spanLock);
+    return span;
+}
+
+// Puts a span record back for reuse once its memory is gone
+static void releaseSpan(Span *span) {
+    pthread_mutex_lock(&spanLock);
+    span -> next = freeSpans;
+    freeSpans = span;
+    pthread_mutex_unlock(&spanLock);
+}
+
+// Maps a new span of pages for a size class and records it in the arena and the page map
+// Returns NULL if no memory could be had
+static Span *allocateSpan(Arena *arena, size_t block_size, int index, ThreadCache *owner) {
+    
+    // Get empty pages from the arena's node pool, which only has to call mmap when it runs dry
+    size_t pages = classPages[index];
+    void *page = getPoolPages(arena -> node, pages);
+
+    if (page == NULL){        // Shouldn't happen, but just validation
+        return NULL;
+    }
+
+    // Fill in a span record for the pages w characteristics
+    // If either that or the page map fails the pages are just lost, which only happens when mmap is failing anyway
+    Span *span = newSpan();
+    if (span == NULL) {
+        return NULL;
+    }
+    span -> start = page;
+    span -> pages = pages;
+    span -> block_size = block_size;
+    span -> owner = owner;
+    span -> class_index = index;
+    span -> arena_id = arena - arenas;
+
+    // No header in the pages, so the blocks get the whole span apart from the color
+    // Blocks are laid out across the whole span, so they can straddle page boundaries
+    size_t span_bytes = pages * PAGE_SIZE;
+    span -> blocks = span_bytes / block_size;
+    if (bitmapMode && span -> blocks > SPAN_BITMAP_WORDS * 64) {
+        span -> blocks = SPAN_BITMAP_WORDS * 64;
+    }
+    size_t colors = (span_bytes - span -> blocks * block_size) / CACHE_LINE + 1;
+
+    // Every page has to map back to the span before any of its blocks are handed out
+    if (!pageMapSet(page, pages, span)) {
+        releaseSpan(span);
+        return NULL;
+    }
+
+    // Put span in pageList for tracking and give it the next color
+    lockCounted(&arena -> lock, &arena -> lock_stats);
+    span -> next = arena -> pageLists[index];
+    arena -> pageLists[index] = span;
+    span -> color = (arena -> nextColor[index]++ % colors) * CACHE_LINE;
+    arena -> stats.pages_mapped += pages;
+    pthread_mutex_unlock(&arena -> lock);
+    return span;
+}
+
+// Address of the first block of a span
+static inline uint8_t *spanBase(const Span *span) {
+    return (uint8_t *)span -> start + span -> color;
+}
+
+// Links count never-used blocks starting at base into a free list, only writing to those blocks
+// Returns the first one and sets tail to the last one
+static void *linkBlocks(uint8_t *base, size_t block_size, int count, void **tail) {
+
+    // Loop through all blocks in the free list and link together
+    for (int i = 0; i < (count - 1); i++) {
         void **current = (void **)(base + i * block_size);  //Getting address of current block
         *current = base + (i + 1) * block_size;     //put address of next block
     }
 
     // Calculates the address of last block and sets that to point to NULL to show end of list
-    void **last = (void **)(base + (blocks - 1) * block_size);
+    void **last = (void **)(base + (count - 1) * block_size);
     *last = NULL;
 
-    //merges the new list with the old one to access more easily
-    void *old_list_head = allFreeLists[index];
-    *last = old_list_head;
-    //Add this new page's free list to the array of all of them
-    allFreeLists[index] = header -> free_list;
+    *tail = last;
+    return base;
+}
+
+// Gets the calling thread's cache, making one the first time a thread allocates
+// Returns NULL if no memory could be mapped for it
+static ThreadCache *getThreadCache(void) {
+    ThreadCache *cache = tcache;
+    if (cache != NULL) {
+        return cache;
+    }
+
+    // Reuse a cache left behind by a thread that is gone if there is one
+    pthread_mutex_lock(&cacheLock);
+    if (freeCaches != NULL) {
+        cache = freeCaches;
+        freeCaches = cache -> next_free;
+        cache -> next_free = NULL;
+
+    // Otherwise carve a zeroed record out of the current chunk, mapping a new chunk when it runs out
+    } else {
+        if (cacheChunkLeft < sizeof(ThreadCache)) {
+            void *chunk = mmap(NULL, CACHE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk != MAP_FAILED) {
+                cacheChunk = chunk;
+                cacheChunkLeft = CACHE_CHUNK;
+            }
+        }
+        if (cacheChunkLeft >= sizeof(ThreadCache)) {
+            cache = (ThreadCache *)cacheChunk;
+            cacheChunk += sizeof(ThreadCache);
+            cacheChunkLeft -= sizeof(ThreadCache);
+            cache -> next = allCaches;
+            allCaches = cache;
+
+            // New threads are handed out round-robin to the arenas (and their shards)
+            // on the NUMA node they are running on
+            unsigned int ticket = atomic_fetch_add(&nextArena, 1);
+            int per_node = numArenas / numNodes;
+            cache -> arena = &arenas[currentNode() + numNodes * (ticket % per_node)];
+            cache -> shard = (ticket / per_node) % CENTRAL_SHARDS;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    atomic_store(&cache -> in_use, 1);
+
+    // tcache is set first since pthread_setspecific may itself call malloc
+    tcache = cache;
+    if (cacheKeyReady) {
+        pthread_setspecific(cacheKey, cache);
+    }
+    return cache;
+}
+
+// Pushes a block freed by another thread onto its owner's remote list with one CAS
+static void pushRemote(ThreadCache *owner, void *ptr, int index) {
+    void *head = atomic_load_explicit(&owner -> remote_free[index], memory_order_relaxed);
+    do {
+        *(void **)ptr = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner -> remote_free[index], &head, ptr,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+// Takes everything other threads have freed back to this cache in one exchange and puts
+// it on the cache list. Returns how many blocks were reclaimed
+static int reclaimRemote(ThreadCache *cache, int index) {
+    if (atomic_load_explicit(&cache -> remote_free[index], memory_order_relaxed) == NULL) {
+        return 0;
+    }
+    void *head = atomic_exchange_explicit(&cache -> remote_free[index], NULL, memory_order_acquire);
+
+    // Walk to the tail to count the blocks, then splice the whole list in front of the cache list
+    int moved = 1;
+    void *tail = head;
+    while (*(void **)tail != NULL) {
+        tail = *(void **)tail;
+        moved++;
+    }
+    *(void **)tail = cache -> lists[index];
+    cache -> lists[index] = head;
+    cache -> counts[index] += moved;
+    return moved;
+}
+
+// Takes a batch off one shard as a NULL-terminated chain: a whole transfer batch if it has
+// one, otherwise up to batch blocks cut off the loose list, otherwise up to batch blocks off
+// the bump range. Bump blocks are only claimed under the lock and linked after it
+// Returns NULL if it's empty
+static void *popShard(CentralList *list, size_t block_size, int batch, int *count) {
+    void *head = NULL;
+    int moved = 0;
+    uint8_t *fresh = NULL;
+
+    lockCounted(&list -> lock, &list -> lock_stats);
+    if (list -> num_batches > 0) {
+        head = list -> batches[--list -> num_batches];
+        moved = batch;
+    } else if (list -> loose != NULL) {
+        head = list -> loose;
+        void *tail = head;
+        moved = 1;
+        while (moved < batch && *(void **)tail != NULL) {
+            tail = *(void **)tail;
+            moved++;
+        }
+        list -> loose = *(void **)tail;
+        list -> loose_count -= moved;
+        *(void **)tail = NULL;
+    } else if (list -> bump_left > 0) {
+        fresh = list -> bump;
+        moved = list -> bump_left < (size_t)batch ? (int)list -> bump_left : batch;
+        list -> bump += moved * block_size;
+        list -> bump_left -= moved;
+    }
+    if (moved > 0) {
+        list -> refills++;
+    }
+    pthread_mutex_unlock(&list -> lock);
+
+    if (fresh != NULL) {
+        void *tail;
+        head = linkBlocks(fresh, block_size, moved, &tail);
+    }
+    *count = moved;
+    return head;
+}
+
+// Makes the rest of a new span the shard's bump range. If another thread's span got there
+// first, whatever is left of that one is linked onto the loose list so it isn't lost
+static void setBump(CentralList *list, uint8_t *base, size_t blocks, size_t block_size) {
+    lockCounted(&list -> lock, &list -> lock_stats);
+    if (list -> bump_left > 0) {
+        void *tail;
+        void *head = linkBlocks(list -> bump, block_size, list -> bump_left, &tail);
+        *(void **)tail = list -> loose;
+        list -> loose = head;
+        list -> loose_count += list -> bump_left;
+    }
+    list -> bump = base;
+    list -> bump_left = blocks;
+    pthread_mutex_unlock(&list -> lock);
+}
+
+// Puts a linked chain of count blocks from head to tail on one shard. A full batch is kept
+// whole in a transfer slot if there is room, anything else is spliced onto the loose list
+static void pushShard(CentralList *list, void *head, void *tail, int count, int batch) {
+    lockCounted(&list -> lock, &list -> lock_stats);
+    if (count == batch && list -> num_batches < TRANSFER_SLOTS) {
+        *(void **)tail = NULL;
+        list -> batches[list -> num_batches++] = head;
+    } else {
+        *(void **)tail = list -> loose;
+        list -> loose = head;
+        list -> loose_count += count;
+    }
+    list -> flushes++;
+    pthread_mutex_unlock(&list -> lock);
+}
+
+// BITMAP SLABS
+// In bitmap mode an arena's blocks aren't kept on lists at all. Each span has a bit per block
+// and each shard keeps a list of its spans with any bits set. Taking a batch scans those bits
+// with find-first-set, and nothing is written into a block until it is handed to a cache
+
+// Puts a span on the front of its shard's partial list, shard lock held
+static void linkPartial(CentralList *list, Span *span) {
+    span -> partial_prev = NULL;
+    span -> partial_next = list -> partial;
+    if (list -> partial != NULL) {
+        list -> partial -> partial_prev = span;
+    }
+    list -> partial = span;
+}
+
+// Takes a span off its shard's partial list, shard lock held
+static void unlinkPartial(CentralList *list, Span *span) {
+    if (span -> partial_prev != NULL) {
+        span -> partial_prev -> partial_next = span -> partial_next;
+    } else {
+        list -> partial = span -> partial_next;
+    }
+    if (span -> partial_next != NULL) {
+        span -> partial_next -> partial_prev = span -> partial_prev;
+    }
+}
+
+// Whether every block of a span is free, so its pages can go back to the kernel
+static inline int spanEmpty(const Span *span) {
+    return span -> free_count == span -> blocks;
+}
+
+// Takes up to batch free blocks out of one shard's spans and links them into a chain
+// Full spans drop off the partial list. Returns NULL if the shard has no free blocks
+static void *popSpans(CentralList *list, int batch, int *count) {
+    void *head = NULL;
+    int moved = 0;
+
+    lockCounted(&list -> lock, &list -> lock_stats);
+    for (;;) {
+        if (list -> partial == NULL && list -> released != NULL) {
+            Span *span = list -> released;
+            list -> released = span -> partial_next;
+            linkPartial(list, span);
+        }
+        if (moved == batch || list -> partial == NULL) {
+            break;
+        }
+        Span *span = list -> partial;
+        uint8_t *base = spanBase(span);
+        if (span -> kept_empty) {
+            span -> kept_empty = 0;
+            list -> empty_spans--;
+        }
+        for (int w = 0; w < SPAN_BITMAP_WORDS && moved < batch; w++) {
+            uint64_t word = span -> bitmap[w];
+            while (word != 0 && moved < batch) {
+                int bit = __builtin_ctzll(word);
+                word &= word - 1;
+                void *block = base + (size_t)(w * 64 + bit) * span -> block_size;
+                *(void **)block = head;
+                head = block;
+                moved++;
+            }
+            span -> free_count -= __builtin_popcountll(span -> bitmap[w] ^ word);
+            span -> bitmap[w] = word;
+        }
+        if (span -> free_count == 0) {
+            unlinkPartial(list, span);
+        }
+    }
+    if (moved > 0) {
+        list -> refills++;
+    }
+    pthread_mutex_unlock(&list -> lock);
+
+    *count = moved;
+    return head;
+}
+
+// Gives the memory of empty spans back to the kernel and puts them on their shard's released
+// list, which is only used once the shard's other spans are full. The spans are on no list
+// meanwhile, so nobody can hand out a block mid-madvise
+// Nothing is stored in a free block in this mode, so losing the contents is fine
+static void releaseEmptySpans(Span *empty) {
+    while (empty != NULL) {
+        Span *next = empty -> partial_next;
+        madvise(empty -> start, empty -> pages * PAGE_SIZE, MADV_DONTNEED);
+
+        CentralList *list = &arenas[empty -> arena_id].allFreeLists[empty -> class_index][empty -> shard];
+        lockCounted(&list -> lock, &list -> lock_stats);
+        empty -> partial_next = list -> released;
+        list -> released = empty;
+        pthread_mutex_unlock(&list -> lock);
+        empty = next;
+    }
+}
+
+// Sets the bit of every block in a NULL-terminated chain. Blocks go to the shard of the span
+// they are in, so the lock is swapped whenever the chain moves to a span of another shard
+// A span that becomes empty has its pages released once the shard already keeps enough empty
+// ones, and never if it is the only span the shard has with free blocks
+static void pushSpans(void *head) {
+    CentralList *held = NULL;
+    Span *empty = NULL;
+
+    while (head != NULL) {
+        void *next = *(void **)head;
+        Span *span = pageToSpan(head);
+        CentralList *list = &arenas[span -> arena_id].allFreeLists[span -> class_index][span -> shard];
+        if (list != held) {
+            if (held != NULL) {
+                pthread_mutex_unlock(&held -> lock);
+            }
+            lockCounted(&list -> lock, &list -> lock_stats);
+            list -> flushes++;
+            held = list;
+        }
+
+        size_t slot = ((uint8_t *)head - spanBase(span)) / span -> block_size;
+        span -> bitmap[slot / 64] |= 1ULL << (slot % 64);
+        if (span -> free_count++ == 0) {
+            linkPartial(list, span);
+        }
+        if (spanEmpty(span)) {
+            if (list -> empty_spans < SPAN_KEEP_EMPTY || (list -> partial == span && span -> partial_next == NULL)) {
+                span -> kept_empty = 1;
+                list -> empty_spans++;
+            } else {
+                unlinkPartial(list, span);
+                span -> partial_next = empty;
+                empty = span;
+            }
+        }
+        head = next;
+    }
+    if (held != NULL) {
+        pthread_mutex_unlock(&held -> lock);
+    }
+    releaseEmptySpans(empty);
+}
+
+// Bitmap mode version of takeCentralBatch: our own shard's spans first, then the others,
+// then a new span whose bits all start set
+static void *takeSpansBatch(Arena *arena, int shard, size_t block_size, int index, ThreadCache *owner, int *count) {
+    for (int i = 0; i < CENTRAL_SHARDS; i++) {
+        void *head = popSpans(&arena -> allFreeLists[index][(shard + i) % CENTRAL_SHARDS], classBatch[index], count);
+        if (head != NULL) {
+            return head;
+        }
+    }
+
+    Span *span = allocateSpan(arena, block_size, index, owner);
+    if (span == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    size_t blocks = span -> blocks;
+    span -> shard = shard;
+    span -> free_count = blocks;
+    for (size_t w = 0; w < blocks / 64; w++) {
+        span -> bitmap[w] = ~0ULL;
+    }
+    if (blocks % 64 != 0) {
+        span -> bitmap[blocks / 64] = (1ULL << (blocks % 64)) - 1;
+    }
+
+    CentralList *list = &arena -> allFreeLists[index][shard];
+    lockCounted(&list -> lock, &list -> lock_stats);
+    linkPartial(list, span);
+    pthread_mutex_unlock(&list -> lock);
+
+    return popSpans(list, classBatch[index], count);
+}
+
+// Takes up to a batch of blocks from the arena as a NULL-terminated chain. Tries our own shard
+// first and then the others, so blocks flushed to any shard get reused before mapping more
+// If every shard is empty a new span is mapped for owner, we link a batch of it and leave the
+// rest as our shard's bump range, so the rest isn't touched until it is needed
+// Sets count to how many were taken
+static void *takeCentralBatch(Arena *arena, int shard, size_t block_size, int index, ThreadCache *owner, int *count) {
+    if (bitmapMode) {
+        return takeSpansBatch(arena, shard, block_size, index, owner, count);
+    }
+    for (int i = 0; i < CENTRAL_SHARDS; i++) {
+        CentralList *list = &arena -> allFreeLists[index][(shard + i) % CENTRAL_SHARDS];
+        void *head = popShard(list, block_size, classBatch[index], count);
+        if (head != NULL) {
+            return head;
+        }
+    }
+
+    Span *span = allocateSpan(arena, block_size, index, owner);
+    if (span == NULL) {
+        *count = 0;
+        return NULL;
+    }
+
+    size_t blocks = span -> blocks;
+    int moved = blocks < (size_t)classBatch[index] ? (int)blocks : classBatch[index];
+    void *tail;
+    void *head = linkBlocks(spanBase(span), block_size, moved, &tail);
+    if (blocks > (size_t)moved) {
+        setBump(&arena -> allFreeLists[index][shard], spanBase(span) + moved * block_size, blocks - moved, block_size);
+    }
+
+    *count = moved;
+    return head;
+}
+
+// Gives a linked chain of count blocks from head to tail back to a shard of the arena
+// In bitmap mode the blocks go back to the spans they came from instead
+static void giveCentralBatch(Arena *arena, int shard, void *head, void *tail, int count, int index) {
+    if (bitmapMode) {
+        *(void **)tail = NULL;
+        pushSpans(head);
+        return;
+    }
+    pushShard(&arena -> allFreeLists[index][shard], head, tail, count, classBatch[index]);
+}
+
+// Moves up to a batch of blocks from its arena into this thread's cache,
+// allocating a new page first if the arena is empty. Returns how many were moved
+// Blocks other threads freed back to this cache are reclaimed first since that needs no lock
+static int refillCache(ThreadCache *cache, size_t block_size, int index) {
+    int moved = reclaimRemote(cache, index);
+    if (moved > 0) {
+        return moved;
+    }
+
+    void *head = takeCentralBatch(cache -> arena, cache -> shard, block_size, index, cache, &moved);
+    cache -> lists[index] = head;
+    cache -> counts[index] += moved;
+    return moved;
+}
+
+// Gives a batch of blocks from this thread's cache back to its arena
+// The batch is found outside the lock so the lock is only held to splice it in
+static void flushCache(ThreadCache *cache, int index) {
+    int batch = classBatch[index];
+    void *head = cache -> lists[index];
+    void *tail = head;
+    for (int i = 1; i < batch; i++) {
+        tail = *(void **)tail;
+    }
+    cache -> lists[index] = *(void **)tail;
+    cache -> counts[index] -= batch;
+
+    giveCentralBatch(cache -> arena, cache -> shard, head, tail, batch, index);
+}
+
+// Gives everything a cache holds, including blocks other threads freed back to it,
+// to the cache's arena. Used when the cache's thread is gone
+static void drainCache(ThreadCache *cache) {
+    for (int index = 0; index < NUM_CLASSES; index++) {
+        reclaimRemote(cache, index);
+
+        void *head = cache -> lists[index];
+        if (head == NULL) {
+            continue;
+        }
+        void *tail = head;
+        while (*(void **)tail != NULL) {
+            tail = *(void **)tail;
+        }
+        giveCentralBatch(cache -> arena, cache -> shard, head, tail, cache -> counts[index], index);
+        cache -> lists[index] = NULL;
+        cache -> counts[index] = 0;
+    }
+}
+
+// Key destructor, runs as a thread exits. Everything the thread had cached goes back to
+// its arena and the cache is queued for the next new thread, so thread churn doesn't
+// strand blocks. Remote frees that arrive from now on see in_use cleared and go to the arena
+static void releaseThreadCache(void *arg) {
+    ThreadCache *cache = (ThreadCache *)arg;
+    tcache = NULL;
+
+    atomic_store(&cache -> in_use, 0);
+    drainCache(cache);
+
+    pthread_mutex_lock(&cacheLock);
+    cache -> next_free = freeCaches;
+    freeCaches = cache;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+#ifdef HAVE_RSEQ
+// Finds this thread's rseq area, using glibc's registration when there is one and registering
+// our own otherwise. Returns NULL if rseq isn't available, which sends the thread to its thread cache
+static struct rseq *getRseqArea(void) {
+    if (rseqArea != NULL || rseqTried) {
+        return rseqArea;
+    }
+    rseqTried = 1;
+
+    if (&__rseq_size != NULL && __rseq_size > 0) {
+        // glibc's area sits at a fixed offset from the thread pointer
+        char *thread_pointer;
+        __asm__("movq %%fs:0, %0" : "=r"(thread_pointer));
+        struct rseq *area = (struct rseq *)(thread_pointer + __rseq_offset);
+        if ((int32_t)area -> cpu_id >= 0) {
+            rseqArea = area;
+        }
+    } else if (syscall(SYS_rseq, &ownRseq, sizeof(ownRseq), 0, RSEQ_SIGNATURE) == 0) {
+        rseqArea = &ownRseq;
+    }
+    return rseqArea;
+}
+
+// In per-CPU mode each CPU refills from and flushes to the arena and shard its cache was
+// given, or the first arena if the CPU couldn't get a cache
+static Arena *cpuArena(struct rseq *rs) {
+    uint32_t cpu = rs -> cpu_id;
+    return (cpu < MAX_CPUS && cpuCaches[cpu] != NULL) ? cpuCaches[cpu] -> arena : &arenas[0];
+}
+
+static int cpuShard(struct rseq *rs) {
+    uint32_t cpu = rs -> cpu_id;
+    return (cpu < MAX_CPUS && cpuCaches[cpu] != NULL) ? cpuCaches[cpu] -> shard : 0;
+}
+
+// Maps a cache for the CPU this thread is on if that CPU doesn't have one yet. The cache
+// lives on the CPU's node and uses one of that node's arenas
+static void ensureCpuCache(struct rseq *rs) {
+    uint32_t cpu = rs -> cpu_id;
+    if (cpu >= MAX_CPUS || cpuCaches[cpu] != NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cacheLock);
+    if (cpuCaches[cpu] == NULL) {
+        void *mem = mmap(NULL, sizeof(CpuCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            int node = currentNode();
+            int per_node = numArenas / numNodes;
+            bindToNode(mem, sizeof(CpuCache), node);
+
+            CpuCache *cpu_cache = (CpuCache *)mem;
+            cpu_cache -> arena = &arenas[node + numNodes * (cpu % per_node)];
+            cpu_cache -> shard = (cpu / per_node) % CENTRAL_SHARDS;
+            __atomic_store_n(&cpuCaches[cpu], cpu_cache, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+// Pops a block off the current CPU's cache. The whole thing is one restartable sequence:
+// if the thread is preempted, migrated or signalled before the final store of the count,
+// the kernel jumps to the abort handler and we start over, so no atomics are needed
+// Returns NULL if this CPU has no cache yet or its slots for the class are empty
+static void *cpuCachePop(struct rseq *rs, int index) {
+    void *block = NULL;
+    intptr_t count_off = index * sizeof(uintptr_t);
+    intptr_t slot_off = offsetof(CpuCache, slots) + (index * CPU_SLOTS - 1) * sizeof(void *);
+
+retry:
+    __asm__ goto(
+        // Critical section descriptor: start, length up to the commit, abort handler
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rs])\n\t"
+        "1:\n\t"
+        "movl 4(%[rs]), %%eax\n\t"                  // cpu_id
+        "cmpl %[max_cpus], %%eax\n\t"
+        "jae %l[slow]\n\t"
+        "movq (%[table], %%rax, 8), %%rcx\n\t"      // this CPU's cache
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[slow]\n\t"
+        "movq (%%rcx, %[count_off]), %%rdx\n\t"     // count for the class
+        "testq %%rdx, %%rdx\n\t"
+        "jz %l[slow]\n\t"
+        "leaq (%%rcx, %[slot_off]), %%rsi\n\t"
+        "movq (%%rsi, %%rdx, 8), %%rsi\n\t"         // top slot
+        "movq %%rsi, (%[out])\n\t"
+        "decq %%rdx\n\t"
+        "movq %%rdx, (%%rcx, %[count_off])\n\t"     // commit
+        "2:\n\t"
+        // Abort handler, the kernel checks the signature right before it
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [rs] "r"(rs), [table] "r"(cpuCaches), [count_off] "r"(count_off),
+          [slot_off] "r"(slot_off), [out] "r"(&block), [max_cpus] "i"(MAX_CPUS)
+        : "rax", "rcx", "rdx", "rsi", "memory", "cc"
+        : slow, abort);
+    return block;
+abort:
+    goto retry;
+slow:
+    return NULL;
+}
+
+// Pushes a block onto the current CPU's cache with the same restartable sequence trick
+// Returns 0 if this CPU has no cache yet or its slots for the class are full. Classes with
+// small batches get fewer slots, two batches' worth like thread caches
+static int cpuCachePush(struct rseq *rs, void *ptr, int index) {
+    uintptr_t slots = 2 * classBatch[index] < CPU_SLOTS ? 2 * classBatch[index] : CPU_SLOTS;
+    intptr_t count_off = index * sizeof(uintptr_t);
+    intptr_t slot_off = offsetof(CpuCache, slots) + index * CPU_SLOTS * sizeof(void *);
+
+retry:
+    __asm__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rs])\n\t"
+        "1:\n\t"
+        "movl 4(%[rs]), %%eax\n\t"
+        "cmpl %[max_cpus], %%eax\n\t"
+        "jae %l[slow]\n\t"
+        "movq (%[table], %%rax, 8), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[slow]\n\t"
+        "movq (%%rcx, %[count_off]), %%rdx\n\t"
+        "cmpq %[slots], %%rdx\n\t"
+        "jae %l[slow]\n\t"
+        "leaq (%%rcx, %[slot_off]), %%rsi\n\t"
+        "movq %[ptr], (%%rsi, %%rdx, 8)\n\t"        // write the slot above the top
+        "incq %%rdx\n\t"
+        "movq %%rdx, (%%rcx, %[count_off])\n\t"     // commit
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [rs] "r"(rs), [table] "r"(cpuCaches), [count_off] "r"(count_off),
+          [slot_off] "r"(slot_off), [ptr] "r"(ptr), [max_cpus] "i"(MAX_CPUS), [slots] "r"(slots)
+        : "rax", "rcx", "rdx", "rsi", "memory", "cc"
+        : slow, abort);
+    return 1;
+abort:
+    goto retry;
+slow:
+    return 0;
+}
+
+// Per-CPU slow path for malloc: takes a batch from the CPU's arena, returns the first block
+// and pushes the rest onto whatever CPU we are on now. Leftovers that don't fit go back
+static void *refillCpuCache(struct rseq *rs, size_t block_size, int index) {
+    ensureCpuCache(rs);
+
+    int count;
+    Arena *arena = cpuArena(rs);
+    int shard = cpuShard(rs);
+    void *head = takeCentralBatch(arena, shard, block_size, index, NULL, &count);
+    if (head == NULL) {
+        return NULL;
+    }
+    void *block = head;
+    head = *(void **)head;
+    count--;
+
+    while (head != NULL) {
+        void *next = *(void **)head;
+        if (!cpuCachePush(rs, head, index)) {
+            break;
+        }
+        head = next;
+        count--;
+    }
+    if (head != NULL) {
+        void *tail = head;
+        while (*(void **)tail != NULL) {
+            tail = *(void **)tail;
+        }
+        giveCentralBatch(arena, shard, head, tail, count, index);
+    }
+    return block;
+}
+
+// Per-CPU slow path for free: the CPU's slots are full (or it has no cache yet), so pop a
+// batch off them and send it back to the arena along with the freed block
+static void flushCpuCache(struct rseq *rs, void *ptr, int index) {
+    ensureCpuCache(rs);
+    if (cpuCachePush(rs, ptr, index)) {
+        return;
+    }
+
+    *(void **)ptr = NULL;
+    void *head = ptr;
+    int count = 1;
+    while (count < classBatch[index]) {
+        void *block = cpuCachePop(rs, index);
+        if (block == NULL) {
+            break;
+        }
+        *(void **)block = head;
+        head = block;
+        count++;
+    }
+    giveCentralBatch(cpuArena(rs), cpuShard(rs), head, ptr, count, index);
+}
+#endif
+
+// Reads an on/off setting from the environment, getenv is safe here since it never allocates
+static int envFlag(const char *name) {
+    const char *value = getenv(name);
+    return value != NULL && value[0] == '1';
+}
+
+// Reads a number from the environment, or returns fallback if it isn't set
+static size_t envNumber(const char *name, size_t fallback) {
+    const char *value = getenv(name);
+    if (value == NULL || value[0] == '\0') {
+        return fallback;
+    }
+    return strtoul(value, NULL, 10);
+}
+
+// Works out how many arenas to use: one per CPU this process may run on unless
+// MYALLOC_ARENAS says otherwise, capped at MAX_ARENAS. Rounded up so every NUMA node
+// gets the same number of arenas
+static int chooseArenaCount(void) {
+    size_t count = 1;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        count = CPU_COUNT(&set);
+    }
+    count = envNumber("MYALLOC_ARENAS", count);
+
+    if (count < 1) {
+        count = 1;
+    }
+    count = (count + numNodes - 1) / numNodes * numNodes;
+    if (count > MAX_ARENAS) {
+        count = MAX_ARENAS / numNodes * numNodes;
+    }
+    return (int)count;
+}
+
+// LARGE MAPPING CACHE
+// Bucket with the biggest page count that is at most pages: bucket k holds k + 1 pages below 4,
+// then four buckets per doubling (4, 5, 6, 7, 8, 10, 12, 14, 16, 20, ...)
+static int largeBucketDown(size_t pages) {
+    if (pages < 4) {
+        return (int)pages - 1;
+    }
+    int lg = 63 - __builtin_clzll((unsigned long long)pages);
+    return 3 + (lg - 2) * 4 + (int)((pages >> (lg - 2)) & 3);
+}
+
+// Bucket with the smallest page count that is at least pages, every mapping in it is big enough
+static int largeBucketUp(size_t pages) {
+    return pages <= 1 ? 0 : largeBucketDown(pages - 1) + 1;
+}
+
+// Milliseconds from a clock that is cheap to read, only used for decay
+static uint64_t nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Takes a mapping out of its bucket and the age list, cache lock held
+static void unlinkLarge(LargeCache *cache, Span *span) {
+    int bucket = largeBucketDown(span -> pages);
+    if (span -> bucket_prev != NULL) {
+        span -> bucket_prev -> bucket_next = span -> bucket_next;
+    } else {
+        cache -> buckets[bucket] = span -> bucket_next;
+    }
+    if (span -> bucket_next != NULL) {
+        span -> bucket_next -> bucket_prev = span -> bucket_prev;
+    }
+
+    if (span -> newer != NULL) {
+        span -> newer -> older = span -> older;
+    } else {
+        cache -> newest = span -> older;
+    }
+    if (span -> older != NULL) {
+        span -> older -> newer = span -> newer;
+    } else {
+        cache -> oldest = span -> newer;
+    }
+    cache -> bytes -= span -> pages * PAGE_SIZE;
+}
+
+// Drops mappings that are too old or over the byte cap from the old end, cache lock held
+// They are chained on next for the caller to unmap once the lock is let go
+static Span *trimLargeCache(LargeCache *cache, uint64_t now) {
+    Span *victims = NULL;
+    while (cache -> oldest != NULL &&
+           (cache -> bytes > largeCacheCap || now - cache -> oldest -> freed_at > largeDecayMs)) {
+        Span *span = cache -> oldest;
+        unlinkLarge(cache, span);
+        span -> next = victims;
+        victims = span;
+    }
+    return victims;
+}
+
+// Unmaps what trimLargeCache dropped and gives back their records
+static void unmapLargeVictims(Span *victims) {
+    while (victims != NULL) {
+        Span *next = victims -> next;
+        munmap(victims -> start, victims -> pages * PAGE_SIZE);
+        releaseSpan(victims);
+        victims = next;
+    }
+}
+
+// Finds a cached mapping of at least pages on a node, NULL if there isn't one
+// It can be up to a bucket bigger than asked for, the span keeps its real length
+static Span *takeLargeCached(int node, size_t pages) {
+    if (largeCacheCap == 0) {
+        return NULL;
+    }
+    int bucket = largeBucketUp(pages);
+    if (bucket >= LARGE_BUCKETS) {
+        return NULL;
+    }
+    LargeCache *cache = &largeCaches[node];
+    pthread_mutex_lock(&cache -> lock);
+    Span *span = cache -> buckets[bucket];
+    if (span != NULL) {
+        unlinkLarge(cache, span);
+    }
+    Span *victims = trimLargeCache(cache, nowMs());
+    pthread_mutex_unlock(&cache -> lock);
+
+    unmapLargeVictims(victims);
+    return span;
+}
+
+// Puts a freed large mapping in its node's cache instead of unmapping it
+// Returns 0 if it doesn't fit in the cache at all, then the caller unmaps it
+static int putLargeCached(Span *span) {
+    size_t bytes = span -> pages * PAGE_SIZE;
+    int bucket = largeBucketDown(span -> pages);
+    if (bytes > largeCacheCap || bucket >= LARGE_BUCKETS) {
+        return 0;
+    }
+    LargeCache *cache = &largeCaches[span -> node];
+
+    // The clock is read with the lock held so freed_at only ever grows along the age list,
+    // otherwise another thread's newer entry would make now - freed_at wrap around
+    pthread_mutex_lock(&cache -> lock);
+    uint64_t now = nowMs();
+    span -> freed_at = now;
+    span -> bucket_prev = NULL;
+    span -> bucket_next = cache -> buckets[bucket];
+    if (span -> bucket_next != NULL) {
+        span -> bucket_next -> bucket_prev = span;
+    }
+    cache -> buckets[bucket] = span;
+
+    span -> newer = NULL;
+    span -> older = cache -> newest;
+    if (cache -> newest != NULL) {
+        cache -> newest -> newer = span;
+    } else {
+        cache -> oldest = span;
+    }
+    cache -> newest = span;
+    cache -> bytes += bytes;
+
+    Span *victims = trimLargeCache(cache, now);
+    pthread_mutex_unlock(&cache -> lock);
+
+    unmapLargeVictims(victims);
+    return 1;
+}
+
+// Maps a new large block of *len bytes. Past the huge page threshold the length is rounded up
+// to whole huge pages and written back to *len, and the mapping is aligned to a huge page by
+// mapping one extra and unmapping the ends, then marked so the kernel uses huge pages for it
+static void *mapLarge(size_t *len) {
+    if (thpThreshold == 0 || *len < thpThreshold) {
+        return mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    size_t huge_len = (*len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    size_t over_len = huge_len + HUGE_PAGE_SIZE - PAGE_SIZE;
+    uint8_t *mem = mmap(NULL, over_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    uint8_t *aligned = (uint8_t *)(((uintptr_t)mem + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned != mem) {
+        munmap(mem, aligned - mem);
+    }
+    if (aligned + huge_len != mem + over_len) {
+        munmap(aligned + huge_len, mem + over_len - (aligned + huge_len));
+    }
+    madvise(aligned, huge_len, MADV_HUGEPAGE);
+    *len = huge_len;
+    return aligned;
+}
+
+// Grows a large block's mapping with mremap, which moves page table entries instead of
+// copying, and lets the kernel move it if it can't grow where it is. Returns 0 if it failed
+static int remapLarge(Span *span, size_t size) {
+    size_t old_size = span -> pages * PAGE_SIZE;
+    size_t new_size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    // Forget the old page before mremap can unmap it, like free() does, since another thread's
+    // mmap can land there as soon as it's gone and set its own entry that we'd then wipe
+    pageMapSet(span -> start, 1, NULL);
+    void *mem = mremap(span -> start, old_size, new_size, MREMAP_MAYMOVE);
+    if (mem == MAP_FAILED) {
+        pageMapSet(span -> start, 1, span);
+        return 0;
+    }
+
+    // Setting the entry can only fail when mmap is failing too, and then the block is just
+    // never freed
+    pageMapSet(mem, 1, span);
+    span -> start = mem;
+    span -> pages = new_size / PAGE_SIZE;
+    span -> size = size;
+    return 1;
+}
+
+// FORK HANDLERS
+// Before fork: take every allocator lock so no other thread is halfway through changing
+// the lists when the child's copy of memory is made
+static void prepareFork(void) {
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < numArenas; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        for (int index = 0; index < NUM_CLASSES; index++) {
+            for (int shard = 0; shard < CENTRAL_SHARDS; shard++) {
+                pthread_mutex_lock(&arenas[i].allFreeLists[index][shard].lock);
+            }
+        }
+    }
+    for (int node = 0; node < numNodes; node++) {
+        pthread_mutex_lock(&largeCaches[node].lock);
+    }
+    pthread_mutex_lock(&spanLock);
+}
+
+// After fork in the parent: everything is still consistent, so just let go in reverse order
+static void afterForkParent(void) {
+    pthread_mutex_unlock(&spanLock);
+    for (int node = numNodes - 1; node >= 0; node--) {
+        pthread_mutex_unlock(&largeCaches[node].lock);
+    }
+    for (int i = numArenas - 1; i >= 0; i--) {
+        for (int index = NUM_CLASSES - 1; index >= 0; index--) {
+            for (int shard = CENTRAL_SHARDS - 1; shard >= 0; shard--) {
+                pthread_mutex_unlock(&arenas[i].allFreeLists[index][shard].lock);
+            }
+        }
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+// Sets up all of an arena's locks
+static void initArenaLocks(Arena *arena) {
+    pthread_mutex_init(&arena -> lock, NULL);
+    for (int index = 0; index < NUM_CLASSES; index++) {
+        for (int shard = 0; shard < CENTRAL_SHARDS; shard++) {
+            pthread_mutex_init(&arena -> allFreeLists[index][shard].lock, NULL);
+        }
+    }
+}
+
+// After fork in the child: only the forking thread exists, so start the locks over and
+// give every other thread's cache back to its arena so those blocks aren't stranded
+// The emptied caches are handed to the child's new threads
+static void afterForkChild(void) {
+    pthread_mutex_init(&cacheLock, NULL);
+    pthread_mutex_init(&spanLock, NULL);
+    for (int node = 0; node < numNodes; node++) {
+        pthread_mutex_init(&largeCaches[node].lock, NULL);
+    }
+    for (int i = 0; i < numArenas; i++) {
+        initArenaLocks(&arenas[i]);
+    }
+
+    freeCaches = NULL;
+    for (ThreadCache *cache = allCaches; cache != NULL; cache = cache -> next) {
+        if (cache == tcache) {
+            continue;
+        }
+        atomic_store(&cache -> in_use, 0);
+        drainCache(cache);
+        cache -> next_free = freeCaches;
+        freeCaches = cache;
+    }
+}
+
+// Runs when the library is loaded. pthread_atfork can allocate, so it is called
+// here instead of from inside malloc, along with making the thread exit key
+__attribute__((constructor))
+static void registerHandlers(void) {
+    pthread_atfork(prepareFork, afterForkParent, afterForkChild);
+
+    if (pthread_key_create(&cacheKey, releaseThreadCache) == 0) {
+        cacheKeyReady = 1;
+        // Threads that allocated before this ran still need their destructor
+        if (tcache != NULL) {
+            pthread_setspecific(cacheKey, tcache);
+        }
+    }
 }
 
 
@@ -125,6 +1675,19 @@ void *malloc(size_t size) {
     // Looked up libc documentation for idea
     if (!initialized) {
         initialized = 1;
+        perCpuMode = envFlag("MYALLOC_PERCPU");
+        lockStatsOn = envFlag("MYALLOC_LOCK_STATS");
+        bitmapMode = envFlag("MYALLOC_BITMAP");
+        largeCacheCap = envNumber("MYALLOC_LARGE_CACHE", LARGE_CACHE_DEFAULT);
+        largeDecayMs = envNumber("MYALLOC_LARGE_DECAY_MS", LARGE_DECAY_DEFAULT_MS);
+        thpThreshold = envNumber("MYALLOC_THP_THRESHOLD", 0);
+        numNodes = countNodes();
+        numArenas = chooseArenaCount();
+        initClasses();
+        for (int i = 0; i < numArenas; i++) {
+            initArenaLocks(&arenas[i]);
+            arenas[i].node = i % numNodes;
+        }
     }
 
     // Round up size if size is 0
@@ -134,46 +1697,97 @@ void *malloc(size_t size) {
 
     // Handle small block requests:
     if (size <= MAX_SMALL) {
-        size_t block_size = roundPageSize(size);
-        int index = sizeToIndex(block_size);
+        int index = sizeToIndex(size);
+        size_t block_size = classSizes[index];
+
+#ifdef HAVE_RSEQ
+        // Per-CPU mode: pop straight off this CPU's cache, threads without rseq fall through
+        struct rseq *rs = perCpuMode ? getRseqArea() : NULL;
+        if (rs != NULL) {
+            void *block = cpuCachePop(rs, index);
+            return block != NULL ? block : refillCpuCache(rs, block_size, index);
+        }
+#endif
+        ThreadCache *cache = getThreadCache();
+
+        // Without a cache (couldn't map one) take a batch from the first arena, keep one
+        // block and give the rest straight back
+        if (cache == NULL) {
+            int count;
+            void *block = takeCentralBatch(&arenas[0], 0, block_size, index, NULL, &count);
+            if (block != NULL && count > 1) {
+                void *tail = block;
+                while (*(void **)tail != NULL) {
+                    tail = *(void **)tail;
+                }
+                giveCentralBatch(&arenas[0], 0, *(void **)block, tail, count - 1, index);
+            }
+            return block;
+        }
         
-        // If there is nothing on the free list to hold new allocation, allocate a new page
-        if (allFreeLists[index] == NULL) {
-            allocatePage(block_size, index);
-            // Make sure allocaation worked before moving on
-            if (allFreeLists[index] == NULL) {
+        // If there is nothing in this thread's cache, grab a batch from its arena
+        if (cache -> lists[index] == NULL) {
+            // Make sure the refill worked before moving on
+            if (refillCache(cache, block_size, index) == 0) {
                 return NULL;
             }
         } 
 
-        // If there is space (or once space is allocated)
+        // If there is space (or once the cache is refilled)
         // Get the address, update list with new address
-        void *block = allFreeLists[index];
-        allFreeLists[index] = *(void **)block;
+        void *block = cache -> lists[index];
+        cache -> lists[index] = *(void **)block;
+        cache -> counts[index]--;
             
         return block; //Return memory block
     }
 
     // Large block requests:
     // Get the needed total size and how much is needed 
-    size_t total_size = sizeof(LargeHeader) + size;
-    size_t mmap_size = (total_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);    //More bitwise math to get size needed
+    size_t mmap_size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);    //More bitwise math to get size needed
+    int node = currentNode();
+
+    // Reuse a mapping freed on this node not long ago if there is one big enough
+    Span *span = takeLargeCached(node, mmap_size / PAGE_SIZE);
+    if (span != NULL) {
+        span -> size = size;
+        span -> zeroed = 0;
+        if (!pageMapSet(span -> start, 1, span)) {
+            munmap(span -> start, span -> pages * PAGE_SIZE);
+            releaseSpan(span);
+            return NULL;
+        }
+        return span -> start;
+    }
+
+    span = newSpan();
+    if (span == NULL) {
+        return NULL;
+    }
 
     // Call mmap to get memory from OS & check it 
-    void *mem = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *mem = mapLarge(&mmap_size);
     if (mem == MAP_FAILED) {
+        releaseSpan(span);
         return NULL;
     }
+    // Keep it on the node of the thread asking for it before anything faults it in
+    bindToNode(mem, mmap_size, node);
 
-    // Same as allocatePage(), but large blocks get entire pages instead of part of one
-    LargeHeader *header = (LargeHeader *)mem;
-    header -> size = size;
-    header -> mmap_size = mmap_size;
-
-    // Find where the data can be put considering header size
-    char *data_start = (char *)mem + sizeof(LargeHeader);
+    // Same as allocateSpan(), but a large block is the whole span and only its first page
+    // goes in the page map since that's the only address free() will see
+    span -> start = mem;
+    span -> pages = mmap_size / PAGE_SIZE;
+    span -> size = size;
+    span -> zeroed = 1;
+    span -> node = node;
+    if (!pageMapSet(mem, 1, span)) {
+        munmap(mem, mmap_size);
+        releaseSpan(span);
+        return NULL;
+    }
     
-    return (void *)data_start;   //Return where data should begin
+    return mem;   //Return where data should begin
 }
 
 // Function to free allocated memory
@@ -182,29 +1796,65 @@ void free(void *ptr) {
     if (ptr == NULL) {  //Just to save myself stress lol
         return;
     }
-    // Get the page that memory is on with more binary operations then get header info to store
-    uintptr_t address_page = (uintptr_t)ptr & ~(PAGE_SIZE - 1);     //0s out lower bits for base (office hours suggestion)
-    PageHeader *page_header = (PageHeader *)address_page;
+    // Look up the span the memory is in, ignoring pointers that aren't ours
+    Span *span = pageToSpan(ptr);
+    if (span == NULL) {
+        return;
+    }
 
-    // Handle small blocks stored inside a page:
-    if ((page_header -> block_size > 0) && (page_header -> block_size <= MAX_SMALL)) {
+    // Handle small blocks stored inside a span:
+    if (span -> block_size != 0) {
         
-        //Get the index of the memory in the list
-        size_t block_size = page_header -> block_size;
-        int index = sizeToIndex(block_size);
+        //Get the index of the memory in the list, the span already knows it
+        int index = span -> class_index;
+
+        // Blocks from a page a thread cache owns go back to that thread's remote list,
+        // unless this is the owning thread itself
+        // If the owner's thread has exited the block goes to the owner's arena instead
+        ThreadCache *owner = span -> owner;
+        if (owner != NULL && owner != tcache) {
+            if (atomic_load(&owner -> in_use)) {
+                pushRemote(owner, ptr, index);
+            } else {
+                giveCentralBatch(owner -> arena, owner -> shard, ptr, ptr, 1, index);
+            }
+            return;
+        }
+
+#ifdef HAVE_RSEQ
+        // Per-CPU mode: push onto this CPU's cache, flushing a batch when it is full
+        struct rseq *rs = perCpuMode ? getRseqArea() : NULL;
+        if (rs != NULL) {
+            if (!cpuCachePush(rs, ptr, index)) {
+                flushCpuCache(rs, ptr, index);
+            }
+            return;
+        }
+#endif
+        ThreadCache *cache = getThreadCache();
+        // No cache at all, so the block goes straight back on the list of the arena the page came from
+        if (cache == NULL) {
+            giveCentralBatch(&arenas[span -> arena_id], 0, ptr, ptr, 1, index);
+            return;
+        }
 
-        //put freed block on the global free list by treating it as ptr, then dereferencing, then changing pointer location
-        *(void **)ptr = allFreeLists[index];
-        allFreeLists[index] = ptr;
+        //put freed block on this thread's cache list by treating it as ptr, then dereferencing, then changing pointer location
+        *(void **)ptr = cache -> lists[index];
+        cache -> lists[index] = ptr;
+
+        // Give a batch back to the arena if this thread is hoarding too many
+        if (++cache -> counts[index] > 2 * classBatch[index]) {
+            flushCache(cache, index);
+        }
 
     // Handle large blocks / entire pages
     } else {
-        // get the header of large block which is the ptr minus size of header
-        LargeHeader *large_block = (LargeHeader *)((char *)ptr - sizeof(LargeHeader));
-    
-        //Unmap the memory assuming that the size is valid
-        if (large_block -> mmap_size > 0){
-            munmap((void *)large_block, large_block -> mmap_size);
+        // Forget the page before caching or unmapping it, so it can't be freed twice and
+        // a new mapping can land on the same address
+        pageMapSet(span -> start, 1, NULL);
+        if (!putLargeCached(span)) {
+            munmap(span -> start, span -> pages * PAGE_SIZE);
+            releaseSpan(span);
         }
     }
 }
@@ -214,13 +1864,25 @@ void free(void *ptr) {
 void *calloc(size_t mem_block, size_t size) {
     
     // Get the total amount of space needed and malloc memory for it
-    size_t total = mem_block * size;
+    // A count and size that overflow would otherwise get a tiny block back
+    size_t total;
+    if (__builtin_mul_overflow(mem_block, size, &total)) {
+        return NULL;
+    }
     void *p = malloc(total);
-    
-    // Assuming it worked, initialize the memory to 0 using memset
-    if (p) {
-        memset(p, 0, total);
+    if (p == NULL) {
+        return NULL;
     }
+
+    // A large block straight from mmap is already zero, so leave its pages alone and let
+    // them fault in when they're used. Anything else gets cleared with memset
+    if (total > MAX_SMALL) {
+        Span *span = pageToSpan(p);
+        if (span -> zeroed) {
+            return p;
+        }
+    }
+    memset(p, 0, total);
     return p;
 }
 
@@ -239,28 +1901,57 @@ void *realloc(void *ptr, size_t size) {
         return NULL; 
     }
 
+    // Same lookup as free() to get the old memory's span
+    Span *span = pageToSpan(ptr);
+    if (span == NULL) {
+        return NULL;
+    }
+
+    // Keep a small block where it is if the new size still fits its class, unless it shrank
+    // enough that a smaller class would hold it in half the space
+    if (span -> block_size != 0 && size <= span -> block_size &&
+        (size > span -> block_size / 2 || classSizes[sizeToIndex(size)] == span -> block_size)) {
+        return ptr;
+    }
+
+    // A large block stays where it is if it still fits in its mapping, giving back any whole
+    // pages past the new end. If it doesn't fit it is grown with mremap, no copying
+    // A size within a page of SIZE_MAX would round up to 0 and look like it fits, so that
+    // fails here and leaves the old block alone
+    if (span -> block_size == 0) {
+        size_t mapped = span -> pages * PAGE_SIZE;
+        size_t needed;
+        if (__builtin_add_overflow(size, PAGE_SIZE - 1, &needed)) {
+            return NULL;
+        }
+        needed &= ~(PAGE_SIZE - 1);
+        if (needed <= mapped) {
+            if (needed < mapped) {
+                munmap((uint8_t *)span -> start + needed, mapped - needed);
+                span -> pages = needed / PAGE_SIZE;
+            }
+            span -> size = size;
+            return ptr;
+        }
+        if (remapLarge(span, size)) {
+            return span -> start;
+        }
+    }
+
     // Get pointer for location to hold new memory by calling malloc
     void *newptr = malloc(size);
     if (!newptr) {     //check it just in case because im anxious
         return NULL;
     }
 
-    // Same math as before to get the page size of old memory 
-    uintptr_t page_addr = (uintptr_t)ptr & ~(PAGE_SIZE - 1);
-
-    // Get the header for that page
-    PageHeader *page_header = (PageHeader *)page_addr;
-
-    // If it was a small page:
+    // If it was a small block:
     size_t old_size; 
-    if (page_header -> block_size > 0 && page_header -> block_size <= MAX_SMALL) {
-        old_size = page_header -> block_size;  //Actual allocated size
+    if (span -> block_size != 0) {
+        old_size = span -> block_size;  //Actual allocated size
     
     // If it was a large:
     } else {
-        //Same offset logic as in free(), only needed for large blocks
-        LargeHeader *large_header = (LargeHeader *)((char *)ptr - sizeof(LargeHeader));
-        old_size = large_header ->size;  //Actual allocated size
+        old_size = span -> size;  //Actual allocated size
     }
 
     // Can only write as much as we initially allocated to avoid writing over other pages 
@@ -274,4 +1965,59 @@ void *realloc(void *ptr, size_t size) {
     // Delete pointer to old memory since not needed anymore and return new address
     free(ptr);
     return newptr;
-}
\ No newline at end of file
+}
+
+
+// STATS FUNCTIONS
+// Number of arenas in use, valid arena numbers for myalloc_get_lock_stats are below this
+int myalloc_arena_count(void) {
+    return numArenas;
+}
+
+// Number of small size classes
+int myalloc_class_count(void) {
+    return NUM_CLASSES;
+}
+
+// Number of shards each arena's free list for a size class is split into
+int myalloc_shard_count(void) {
+    return CENTRAL_SHARDS;
+}
+
+// Adds one shard's counters to out, reading them under the shard's lock
+static void addShardStats(CentralList *list, myalloc_lock_stats *out) {
+    pthread_mutex_lock(&list -> lock);
+    out -> acquisitions += list -> lock_stats.acquisitions;
+    out -> contended += list -> lock_stats.contended;
+    out -> wait_cycles += list -> lock_stats.wait_cycles;
+    out -> refills += list -> refills;
+    out -> flushes += list -> flushes;
+    pthread_mutex_unlock(&list -> lock);
+}
+
+// Fills out with the lock counters for one arena. size_class picks a size class's free list
+// (or -1 for the arena's page lock) and shard picks one shard of it (or -1 for all of them)
+// Returns 0, or -1 if any of the numbers are out of range
+int myalloc_get_lock_stats(int arena, int size_class, int shard, myalloc_lock_stats *out) {
+    if (out == NULL || arena < 0 || arena >= numArenas || size_class < -1 || size_class >= NUM_CLASSES ||
+        shard < -1 || shard >= CENTRAL_SHARDS) {
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    Arena *a = &arenas[arena];
+
+    if (size_class == -1) {
+        pthread_mutex_lock(&a -> lock);
+        out -> acquisitions = a -> lock_stats.acquisitions;
+        out -> contended = a -> lock_stats.contended;
+        out -> wait_cycles = a -> lock_stats.wait_cycles;
+        pthread_mutex_unlock(&a -> lock);
+        return 0;
+    }
+    for (int i = 0; i < CENTRAL_SHARDS; i++) {
+        if (shard == -1 || shard == i) {
+            addShardStats(&a -> allFreeLists[size_class][i], out);
+        }
+    }
+    return 0;
+}
@@ -1,17 +1,34 @@
-#ifndef ALLOCATOR.H
-#define ALLOCATOR.H
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
 
 #include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
 
-static size_t roundPageSize(size_t size);
-
 
 void* malloc(size_t size);
 void free(void *ptr);
 void* calloc(size_t nmemb, size_t size);
 void* realloc(void *ptr, size_t size);
 
-#endif
\ No newline at end of file
+// Lock counters for one arena lock or size class free list, only collected when the
+// program runs with MYALLOC_LOCK_STATS=1. wait_cycles is in TSC cycles on x86 and
+// nanoseconds elsewhere
+typedef struct myalloc_lock_stats {
+    uint64_t acquisitions;
+    uint64_t contended;     // acquisitions that had to wait for another thread
+    uint64_t wait_cycles;   // total time spent waiting on contended acquisitions
+    uint64_t refills;       // batches handed out (size class free lists only)
+    uint64_t flushes;       // batches given back (size class free lists only)
+} myalloc_lock_stats;
+
+int myalloc_arena_count(void);
+int myalloc_class_count(void);
+int myalloc_shard_count(void);
+
+// size_class -1 reads the arena's page lock, shard -1 adds up every shard of a size class
+// Returns 0, or -1 if any argument is out of range
+int myalloc_get_lock_stats(int arena, int size_class, int shard, myalloc_lock_stats *out);
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Benchmarks for the allocator. Build with "make bench" and run against the library with
+//     LD_PRELOAD=./libmyalloc.so ./bench [name]
+// With no name every benchmark runs
+
+#define FREE_HEAVY_BLOCKS 1000000
+#define FREE_HEAVY_ROUNDS 10
+#define MEDIUM_OPS 2000000
+#define MEDIUM_LIVE 256
+#define WALK_OBJECTS 4096
+#define WALK_ROUNDS 2000
+#define LARGE_LOOP_OPS 20000
+#define GROW_MAX (256 * 1024 * 1024)
+#define GROW_ROUNDS 5
+#define BUILDER_STRINGS 20000
+#define BUILDER_MAX 4096
+#define CALLOC_OPS 200
+#define CALLOC_SIZE (128 * 1024 * 1024)
+#define TABLE_SIZE (512 * 1024 * 1024)
+#define TABLE_READS 50000000
+
+// Stops the compiler from dropping a malloc/free pair whose memory is never read
+static void *volatile sink;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// free-heavy: allocate a million small blocks of mixed sizes, then time freeing them all
+// Frees go in a shuffled order so they don't just undo the mallocs one by one
+static void benchFreeHeavy(void)
+{
+	void **bufs = malloc(FREE_HEAVY_BLOCKS * sizeof(void *));
+	size_t *order = malloc(FREE_HEAVY_BLOCKS * sizeof(size_t));
+	double malloc_time = 0, free_time = 0;
+	unsigned int seed = 1;
+
+	for (size_t i = 0; i < FREE_HEAVY_BLOCKS; i++)
+	{
+		order[i] = i;
+	}
+	for (size_t i = FREE_HEAVY_BLOCKS - 1; i > 0; i--)
+	{
+		size_t j = rand_r(&seed) % (i + 1);
+		size_t tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for (int round = 0; round < FREE_HEAVY_ROUNDS; round++)
+	{
+		double start = now();
+		for (size_t i = 0; i < FREE_HEAVY_BLOCKS; i++)
+		{
+			bufs[i] = malloc(1 + rand_r(&seed) % 1024);
+		}
+		double mid = now();
+		for (size_t i = 0; i < FREE_HEAVY_BLOCKS; i++)
+		{
+			free(bufs[order[i]]);
+		}
+		double end = now();
+
+		malloc_time += mid - start;
+		free_time += end - mid;
+	}
+
+	double ops = (double)FREE_HEAVY_BLOCKS * FREE_HEAVY_ROUNDS;
+	printf("free-heavy: malloc %.1f ns/op, free %.1f ns/op\n", malloc_time / ops * 1e9, free_time / ops * 1e9);
+
+	free(order);
+	free(bufs);
+}
+
+// medium: mallocs and frees of 1KB to 256KB blocks with a small set kept live, like
+// string and buffer churn. Each op frees a random live block and replaces it
+static void benchMedium(void)
+{
+	void *live[MEDIUM_LIVE] = {NULL};
+	unsigned int seed = 1;
+
+	double start = now();
+	for (size_t i = 0; i < MEDIUM_OPS; i++)
+	{
+		size_t slot = rand_r(&seed) % MEDIUM_LIVE;
+		free(live[slot]);
+		size_t size = 1024 + rand_r(&seed) % (255 * 1024);
+		live[slot] = malloc(size);
+		*(char *)live[slot] = 1;
+	}
+	double end = now();
+
+	for (size_t i = 0; i < MEDIUM_LIVE; i++)
+	{
+		free(live[i]);
+	}
+	printf("medium: %.1f ns/op\n", (end - start) / MEDIUM_OPS * 1e9);
+}
+
+// walk: allocate a few thousand same-class objects and repeatedly read the first word of
+// each, like walking a list of small structs. The objects' first cache lines fall in the
+// same cache sets unless spans are coloured, so this mostly measures conflict misses
+static void benchWalk(void)
+{
+	static const size_t sizes[] = {1400, 3000, 7000};
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		long **objs = malloc(WALK_OBJECTS * sizeof(long *));
+		for (size_t i = 0; i < WALK_OBJECTS; i++)
+		{
+			objs[i] = malloc(sizes[s]);
+			objs[i][0] = (long)i;
+		}
+
+		long sum = 0;
+		double start = now();
+		for (int round = 0; round < WALK_ROUNDS; round++)
+		{
+			for (size_t i = 0; i < WALK_OBJECTS; i++)
+			{
+				sum += objs[i][0];
+			}
+		}
+		double end = now();
+
+		printf("walk %zu: %.2f ns/object (sum %ld)\n", sizes[s], (end - start) / ((double)WALK_OBJECTS * WALK_ROUNDS) * 1e9, sum);
+		for (size_t i = 0; i < WALK_OBJECTS; i++)
+		{
+			free(objs[i]);
+		}
+		free(objs);
+	}
+}
+
+// large-loop: a request loop that mallocs a 1MB buffer, fills a few pages of it and frees it
+static void benchLargeLoop(void)
+{
+	double start = now();
+	for (int i = 0; i < LARGE_LOOP_OPS; i++)
+	{
+		char *buf = malloc(1024 * 1024);
+		memset(buf, i, 16 * 1024);
+		sink = buf;
+		free(sink);
+	}
+	double end = now();
+	printf("large-loop: %.1f ns/op\n", (end - start) / LARGE_LOOP_OPS * 1e9);
+}
+
+// realloc-grow: a vector that doubles its buffer with realloc from 16 bytes to 256MB,
+// writing one byte per page of each new half like pushing elements would
+static void benchReallocGrow(void)
+{
+	double total = 0;
+	for (int round = 0; round < GROW_ROUNDS; round++)
+	{
+		double start = now();
+		char *buf = malloc(16);
+		buf[0] = 1;
+		for (size_t size = 32; size <= GROW_MAX; size *= 2)
+		{
+			buf = realloc(buf, size);
+			for (size_t i = size / 2; i < size; i += 4096)
+			{
+				buf[i] = 1;
+			}
+		}
+		free(buf);
+		total += now() - start;
+	}
+	printf("realloc-grow: %.2f ms per growth to 256MB\n", total / GROW_ROUNDS * 1e3);
+}
+
+// string-builder: strings grown a few bytes at a time with realloc up to 4KB, the way a
+// string builder appends without keeping its own capacity
+static void benchStringBuilder(void)
+{
+	unsigned int seed = 1;
+	size_t reallocs = 0;
+	double start = now();
+	for (int i = 0; i < BUILDER_STRINGS; i++)
+	{
+		size_t len = 0;
+		char *str = NULL;
+		while (len < BUILDER_MAX)
+		{
+			size_t add = 1 + rand_r(&seed) % 32;
+			str = realloc(str, len + add + 1);
+			memset(str + len, 'a', add);
+			len += add;
+			str[len] = '\0';
+			reallocs++;
+		}
+		sink = str;
+		free(sink);
+	}
+	double end = now();
+	printf("string-builder: %.1f ns/realloc\n", (end - start) / reallocs * 1e9);
+}
+
+// calloc-large: a big zeroed table that only gets a few of its pages used before it is freed
+static void benchCallocLarge(void)
+{
+	double start = now();
+	for (int i = 0; i < CALLOC_OPS; i++)
+	{
+		char *table = calloc(CALLOC_SIZE / 8, 8);
+		for (size_t j = 0; j < 16; j++)
+		{
+			table[j * 4096 * 1024] += 1;
+		}
+		sink = table;
+		free(sink);
+	}
+	double end = now();
+	printf("calloc-large: %.1f us/op\n", (end - start) / CALLOC_OPS * 1e6);
+}
+
+// random-access: random reads from a 512MB table, like probing a big hash table, which mostly
+// measures TLB misses. Compare runs with and without MYALLOC_THP_THRESHOLD set
+static void benchRandomAccess(void)
+{
+	size_t slots = TABLE_SIZE / sizeof(uint64_t);
+	uint64_t *table = malloc(TABLE_SIZE);
+	for (size_t i = 0; i < slots; i++)
+	{
+		table[i] = i;
+	}
+
+	uint64_t x = 1, sum = 0;
+	double start = now();
+	for (size_t i = 0; i < TABLE_READS; i++)
+	{
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		sum += table[(x >> 16) % slots];
+	}
+	double end = now();
+
+	printf("random-access: %.2f ns/read (sum %llu)\n", (end - start) / TABLE_READS * 1e9, (unsigned long long)sum);
+	free(table);
+}
+
+struct bench {
+	const char *name;
+	void (*run)(void);
+};
+
+static struct bench benches[] = {
+	{"free-heavy", benchFreeHeavy},
+	{"medium", benchMedium},
+	{"walk", benchWalk},
+	{"large-loop", benchLargeLoop},
+	{"realloc-grow", benchReallocGrow},
+	{"string-builder", benchStringBuilder},
+	{"calloc-large", benchCallocLarge},
+	{"random-access", benchRandomAccess},
+};
+
+int main(int argc, char **argv)
+{
+	int ran = 0;
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+	{
+		if (argc < 2 || strcmp(argv[1], benches[i].name) == 0)
+		{
+			benches[i].run();
+			ran = 1;
+		}
+	}
+	if (!ran)
+	{
+		fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+// Several threads growing and shrinking large blocks with realloc while the others map
+// and unmap, so mremap moving a block races with other threads' mmaps landing on the
+// address it just left. A block whose page map entry got lost comes back from realloc
+// as NULL, and its contents are checked after every move
+// Build with "gcc -pthread -o realloc_test realloc_test.c", run with
+//     LD_PRELOAD=./libmyalloc.so ./realloc_test
+// and again with MYALLOC_LARGE_CACHE=0 so every large free really unmaps
+
+#define THREADS 8
+#define LIVE 32
+#define ROUNDS 2000
+#define MIN_SIZE (300 * 1024)
+#define MAX_SIZE (2 * 1024 * 1024)
+
+struct block {
+	uint8_t *ptr;
+	size_t size;
+};
+
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(uintptr_t)arg;
+	uint8_t tag = (uint8_t)(uintptr_t)arg;
+	struct block blocks[LIVE];
+
+	for (int i = 0; i < LIVE; i++)
+	{
+		blocks[i].size = MIN_SIZE;
+		blocks[i].ptr = malloc(MIN_SIZE);
+		assert(blocks[i].ptr != NULL);
+		blocks[i].ptr[0] = tag;
+		blocks[i].ptr[MIN_SIZE - 1] = tag;
+	}
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		struct block *b = &blocks[rand_r(&seed) % LIVE];
+		size_t size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE);
+		uint8_t *p = realloc(b -> ptr, size);
+		assert(p != NULL);
+		assert(p[0] == tag);
+		if (size >= b -> size)
+		{
+			assert(p[b -> size - 1] == tag);
+		}
+		p[size - 1] = tag;
+		b -> ptr = p;
+		b -> size = size;
+
+		// Churn some fresh mappings so they can land where a block used to be
+		void *extra = malloc(MIN_SIZE + rand_r(&seed) % MIN_SIZE);
+		assert(extra != NULL);
+		free(extra);
+	}
+
+	for (int i = 0; i < LIVE; i++)
+	{
+		free(blocks[i].ptr);
+	}
+	return NULL;
+}
+
+int main()
+{
+	// A size too big to round up to whole pages fails and leaves the block as it was
+	// The sizes go through a volatile so the compiler doesn't warn about them
+	volatile size_t huge = SIZE_MAX;
+	uint8_t *big = malloc(MIN_SIZE);
+	assert(big != NULL);
+	memset(big, 7, MIN_SIZE);
+	assert(realloc(big, huge) == NULL);
+	assert(realloc(big, huge - 4096) == NULL);
+	assert(big[0] == 7 && big[MIN_SIZE - 1] == 7);
+	free(big);
+
+	pthread_t threads[THREADS];
+	for (uintptr_t i = 0; i < THREADS; i++)
+	{
+		pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+	}
+	for (int i = 0; i < THREADS; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	printf("realloc_test passed\n");
+	return 0;
+}